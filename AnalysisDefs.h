@@ -0,0 +1,184 @@
+#pragma once
+
+// Constants, Vars, Cuts and helpers shared by the multi-sample analysis macros
+// (AllAnalyses.C and friends). The single-plot macros (RecoMethods.C etc.)
+// keep their own copies so they can still be run on their own.
+
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Core/Cut.h"
+#include "CAFAna/Core/Var.h"
+#include "CAFAna/Core/Utilities.h"
+#include "CAFAna/Vars/Vars.h" // Variables
+#include "CAFAna/Cuts/TruthCuts.h" // Cuts
+#include "StandardRecord/SRProxy.h" // A wrapper for the CAF format
+#include "TDirectory.h"
+#include "TH1.h" // 1-dimensional histogram
+#include <cmath>
+#include <string>
+#include <vector>
+
+const double M_P = .938; // Proton mass in GeV
+const double M_N = .939; // Neutron mass in GeV
+const double M_MU = .106; // Muon mass in GeV
+const double E_B = .028; // Binding energy for nucleons in argon-40 in GeV
+
+const int MODE_QE = 1;
+const int MODE_RES = 4;
+const int MODE_DIS = 3;
+const int MODE_MEC = 10;
+
+const int PDG_MU=13;
+const int PDG_E=11;
+const int PDG_NUMU=14;
+const int PDG_NUE=12;
+
+// The four CAF samples every macro picks between by hand
+struct Sample
+{
+  std::string name; // Used for output directory names and plot titles
+  std::string glob; // Wildcard handed to the SpectrumLoader
+};
+
+// The files of SmearMatrix.C, InteractionType.C, StackedHistogram.C and
+// ESpectra.C. RecoMethods.C on its own reads only CAF_*_90*.root.
+const std::vector<Sample> kSamples = {
+  {"NDGAr_FHC", "/scratch/cpatrick/DuneSchool/CAFs/NDGAr/CAF_FHC_9**.root"}, //ND-GAr FHC
+  {"NDGAr_RHC", "/scratch/cpatrick/DuneSchool/CAFs/NDGAr/CAF_RHC_9**.root"}, //ND-GAr RHC
+  {"NDLAr_FHC", "/scratch/cpatrick/DuneSchool/CAFs/NDLAr/CAF_FHC_9**.root"}, //ND-LAr FHC
+  {"NDLAr_RHC", "/scratch/cpatrick/DuneSchool/CAFs/NDLAr/CAF_RHC_9**.root"}, //ND-LAr RHC
+};
+
+// Where SkimCAF.C writes the slim copy of cafName, one of the files of sample s
+inline std::string SkimFileName(const std::string& skimDir, const Sample& s, const std::string& cafName)
+{
+  return skimDir + "/" + s.name + "/" + cafName.substr(cafName.rfind('/') + 1);
+}
+
+// Every skimmed file of sample s
+inline std::string SkimGlob(const std::string& skimDir, const Sample& s)
+{
+  return skimDir + "/" + s.name + "/*.root";
+}
+
+// Where SyntheticCAF.C writes file i of a made-up sample, named like the real ones
+inline std::string SyntheticFileName(const std::string& dir, const Sample& s, int i)
+{
+  const std::string horn = s.name.substr(s.name.size()-3); // FHC or RHC
+  return dir + "/" + s.name + "/CAF_" + horn + "_" + std::to_string(900 + i) + ".root";
+}
+
+inline std::string SyntheticGlob(const std::string& dir, const Sample& s)
+{
+  return dir + "/" + s.name + "/CAF_*.root";
+}
+
+inline double QEFormula(double Emu, double cosmu) // Muon energy and cosine of muon angle
+{
+  using ana::util::sqr;
+  const double pmu = sqrt(sqr(Emu) - sqr(M_MU));
+  const double num = sqr(M_P) - sqr(M_N - E_B) - sqr(M_MU) + 2 * (M_N - E_B) * Emu;
+  const double denom = 2 * (M_N - E_B - Emu + pmu * cosmu);
+  return num/denom;
+}
+
+// Energy estimators
+const ana::Var kConservedETrue([](const caf::SRProxy* sr)
+                               {
+                                 const double Emu = sr->LepE;
+                                 const double protonKE = sr->eP;
+                                 return Emu + (protonKE + M_P) - (M_N - E_B);
+                               });
+
+const ana::Var kConservedEReco([](const caf::SRProxy* sr)
+                               {
+                                 const double Emu = sr->Elep_reco; // Final-state reconstructed lepton (muon) energy
+                                 const double protonKE = sr->eRecoP; // kinetic energy
+                                 return Emu + (protonKE + M_P) - (M_N - E_B);
+                               });
+
+const ana::Var kRecoE([](const caf::SRProxy* sr)
+                      {
+                        if(std::isnan(sr->Ev_reco)) return 0.;
+                        return double(sr->Ev_reco);
+                      });
+
+const ana::Var kQEFormulaEnergy([](const caf::SRProxy* sr)
+                                {
+                                  const double Emu = sr->Elep_reco;
+                                  const double cosmu = cos(sr->theta_reco);
+                                  if(Emu == 0) return 0.;
+                                  return QEFormula(Emu, cosmu);
+                                });
+
+const ana::Var kRecoEnergy([](const caf::SRProxy* sr) { return double(sr->Ev_reco); }); // Reco neutrino energy, NaN kept
+
+// Interaction modes
+const ana::Cut kIsQE([](const caf::SRProxy* sr) { return sr->mode == MODE_QE; });
+const ana::Cut kIsMEC([](const caf::SRProxy* sr) { return sr->mode == MODE_MEC; });
+const ana::Cut kIsDIS([](const caf::SRProxy* sr) { return sr->mode == MODE_DIS; });
+const ana::Cut kIsRES([](const caf::SRProxy* sr) { return sr->mode == MODE_RES; });
+const ana::Cut kIsCCQE = kIsQE && ana::kIsNumuCC && !ana::kIsAntiNu;
+
+// The four modes above as 0-3, in the order of kModeLabels, -1 for anything else
+const std::vector<std::string> kModeLabels = {"CCQE", "RES", "DIS", "MEC"};
+const ana::Var kModeIndex([](const caf::SRProxy* sr)
+                          {
+                            switch(int(sr->mode)){
+                            case MODE_QE: return 0.;
+                            case MODE_RES: return 1.;
+                            case MODE_DIS: return 2.;
+                            case MODE_MEC: return 3.;
+                            default: return -1.;
+                            }
+                          });
+
+// Final states
+/*
+ The CCQE final state is 1 proton and 1 muon, no other particles.
+ This version also asks for a sane reconstructed energy, as used for the
+ reconstruction-method comparisons (RecoMethods.C, SmearMatrix.C).
+ */
+const ana::Cut kHasQEFinalState([](const caf::SRProxy* sr)
+                                {
+                                  if(std::isnan(sr->Ev_reco)) return false;
+                                  if(sr->Ev_reco<=0.) return false;
+                                  if(sr->Elep_reco<=0.) return false;
+                                  const int totOthers = sr->nN + sr->nipip + sr->nipim + sr->nipi0 + sr->nikp + sr->nikm + sr->nik0 + sr->niem + sr->nNucleus;
+                                  return sr->LepPDG == PDG_MU && sr->nP == 1 && totOthers == 0;
+                                });
+
+// Truth-only version of the above, as used in InteractionType.C
+const ana::Cut kHasTrueQEFinalState([](const caf::SRProxy* sr)
+                                    {
+                                      const int totOthers = sr->nN + sr->nipip + sr->nipim + sr->nipi0 + sr->nikp + sr->nikm + sr->nik0 + sr->niem + sr->nNucleus;
+                                      return sr->LepPDG == PDG_MU && sr->nP == 1 && totOthers == 0;
+                                    });
+
+const ana::Cut kHasCC0PiFinalState([](const caf::SRProxy* sr)
+                                   {
+                                     const int totPi = sr->nipip + sr->nipim + sr->nipi0;
+                                     return sr->LepPDG == PDG_MU && sr->nP >= 1 && totPi == 0;
+                                   });
+
+// CC0pi condition: No pions, no other hadrons except protons and neutrons
+const ana::Cut kCC0pi([](const caf::SRProxy* sr)
+                      {
+                        const int totalPions = sr->nipip + sr->nipim + sr->nipi0;
+                        const int otherHadrons = sr->nikp + sr->nikm + sr->nik0 + sr->niem + sr->nNucleus;
+                        return totalPions == 0 && otherHadrons == 0;
+                      });
+
+const ana::Cut kValidReco([](const caf::SRProxy* sr) { return sr->Ev_reco > 0; });
+
+// Writes name "a/b/c" as histogram "c" in directory "a/b" below dir
+inline void WriteHist(TDirectory* dir, const std::string& name, TH1* h)
+{
+  const size_t slash = name.rfind('/');
+  if(slash != std::string::npos){
+    const std::string sub = name.substr(0, slash);
+    if(!dir->GetDirectory(sub.c_str())) dir->mkdir(sub.c_str());
+    dir = dir->GetDirectory(sub.c_str());
+  }
+  h->SetName(name.substr(slash+1).c_str());
+  dir->WriteTObject(h);
+}
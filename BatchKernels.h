@@ -0,0 +1,109 @@
+#pragma once
+
+/*
+ Structure-of-arrays versions of the reco-method Vars and Cuts in
+ AnalysisDefs.h, evaluated over a block of events at a time. Every loop is a
+ plain arithmetic loop with selects instead of branches, which GCC vectorises
+ at -O3 with -fno-math-errno (sqrt sets errno otherwise). ACLiC's +O is
+ usually -O2, which vectorises none of them, so load with
+
+   gSystem->SetFlagsOpt("-O3 -fno-math-errno");
+   .L BatchKernels.C+O
+
+ BatchKernelsBenchmark() says which flags it was built with. Do not use
+ -ffast-math: the NaN checks rely on x != x.
+ */
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "AnalysisDefs.h"
+
+#if defined(__OPTIMIZE__) && defined(__NO_MATH_ERRNO__)
+const bool kBatchKernelsVectorFlags = true;
+#else
+const bool kBatchKernelsVectorFlags = false;
+#endif
+
+// The columns the kernels read, one entry per event, in the types of the CAF branches
+struct EventBlock
+{
+  static const int kNOthers = 9;
+
+  void Resize(size_t n)
+  {
+    size = n;
+    for(std::vector<double>* v: {&Ev, &Ev_reco, &Elep_reco, &LepE, &eP, &eRecoP, &theta_reco}) v->resize(n);
+    for(std::vector<int>* v: {&LepPDG, &nP, &mode}) v->resize(n);
+    for(int k = 0; k < kNOthers; ++k) nOthers[k].resize(n);
+  }
+
+  size_t size = 0;
+  std::vector<double> Ev, Ev_reco, Elep_reco, LepE, eP, eRecoP, theta_reco;
+  std::vector<int> LepPDG, nP, mode;
+  std::vector<int> nOthers[kNOthers]; // Same order as kOthersBranches
+};
+
+// The multiplicities that must all be zero for a QE final state
+const char* const kOthersBranches[EventBlock::kNOthers] = {
+  "nN", "nipip", "nipim", "nipi0", "nikp", "nikm", "nik0", "niem", "nNucleus"
+};
+
+// kConservedETrue / kConservedEReco
+inline void ConservedEBatch(const double* __restrict Emu, const double* __restrict protonKE,
+                            size_t n, double* __restrict out)
+{
+  for(size_t i = 0; i < n; ++i)
+    out[i] = Emu[i] + (protonKE[i] + M_P) - (M_N - E_B);
+}
+
+// kRecoE: NaN goes to zero
+inline void RecoEBatch(const double* __restrict Ev_reco, size_t n, double* __restrict out)
+{
+  for(size_t i = 0; i < n; ++i){
+    const double E = Ev_reco[i];
+    out[i] = (E == E) ? E : 0.;
+  }
+}
+
+/*
+ kQEFormulaEnergy, in three passes over out. cos() has no vector version
+ without -ffast-math, so it has a scalar pass of its own. The formula is then
+ evaluated for every event, and zero lepton energy set to zero afterwards, as
+ in the scalar Var: choosing between sqrt/divide results and 0 in one loop
+ would need -fno-trapping-math to vectorise.
+ */
+inline void QEFormulaBatch(const double* __restrict Emu, const double* __restrict theta,
+                           size_t n, double* __restrict out)
+{
+  for(size_t i = 0; i < n; ++i) out[i] = cos(theta[i]);
+
+  const double Mnb = M_N - E_B;
+  const double numConst = M_P*M_P - Mnb*Mnb - M_MU*M_MU;
+  for(size_t i = 0; i < n; ++i){
+    const double E = Emu[i];
+    const double pmu = sqrt(E*E - M_MU*M_MU);
+    out[i] = (numConst + 2 * Mnb * E) / (2 * (Mnb - E + pmu * out[i]));
+  }
+
+  for(size_t i = 0; i < n; ++i) out[i] = (Emu[i] == 0) ? 0. : out[i];
+}
+
+// kHasQEFinalState for events [first, first+n) of b, one byte per event, 1 if it passes
+inline void QEFinalStateMaskBatch(const EventBlock& b, size_t first, size_t n, uint8_t* __restrict mask)
+{
+  const double* __restrict Ev_reco = b.Ev_reco.data() + first;
+  const double* __restrict Elep_reco = b.Elep_reco.data() + first;
+  const int* __restrict pdg = b.LepPDG.data() + first;
+  const int* __restrict nP = b.nP.data() + first;
+  const int* o[EventBlock::kNOthers];
+  for(int k = 0; k < EventBlock::kNOthers; ++k) o[k] = b.nOthers[k].data() + first;
+
+  for(size_t i = 0; i < n; ++i){
+    const int totOthers = o[0][i] + o[1][i] + o[2][i] + o[3][i] + o[4][i] + o[5][i] + o[6][i] + o[7][i] + o[8][i];
+    // NaN fails Ev_reco > 0 on its own
+    mask[i] = (Ev_reco[i] > 0.) & (Elep_reco[i] > 0.) & (pdg[i] == PDG_MU) & (nP[i] == 1) & (totOthers == 0);
+  }
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+// Poisson-bootstrap universes for statistical error bands. Each event gets a
+// Poisson(1) weight per universe from a counter-based hash of its ID, so the
+// weights never need storing, and the result does not depend on file order or
+// threading.
+
+#include "TH1.h" // 1-dimensional histogram
+#include "TH2.h" // 2-dimensional histogram
+#include "TDirectory.h"
+#include "TVectorD.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// (run, subrun, event) packed into one key. Assumes event < 2^24 and
+// subrun < 2^20, which holds for our CAFs.
+inline uint64_t EventKey(int run, int subrun, int event)
+{
+  return (uint64_t(uint32_t(run)) << 44) ^ (uint64_t(uint32_t(subrun)) << 24) ^ uint64_t(uint32_t(event));
+}
+
+/*
+ The Poisson(1) weights of one event in every universe. weight(key, u) is a
+ pure function of its arguments (a hash of key and u turned into a Poisson
+ draw by comparing against the CDF), and the loop over universes has no
+ branches, so GCC vectorises it at -O3.
+ */
+class PoissonUniverses
+{
+public:
+  PoissonUniverses(int nUniv, uint64_t seed = 0) : fSeed(seed), fWeights(nUniv) {}
+
+  int NUniverses() const { return fWeights.size(); }
+  uint64_t Seed() const { return fSeed; }
+
+  // Fills and returns the weights of event key, valid until the next call
+  const float* Weights(uint64_t key)
+  {
+    // CDF of Poisson(1) at 0..6, as fractions of 2^32. Draws above 6 have
+    // probability 8e-5 and all come out as 7.
+    static const uint32_t kCDF[7] = {1580030169u, 3160060337u, 3950075422u, 4213413783u,
+                                     4279248374u, 4292415292u, 4294609778u};
+    // The 64-bit key is mixed once (SplitMix64), then each universe only needs
+    // a 32-bit hash, which vectorises where a 64-bit multiply would not
+    uint64_t z = (key ^ fSeed) + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    const uint32_t base = (z ^ (z >> 31)) >> 32;
+    float* w = fWeights.data();
+    const int n = fWeights.size();
+    for(int u = 0; u < n; ++u){
+      uint32_t r = base + uint32_t(u) * 0x9E3779B9u; // lowbias32 of base + u * golden ratio
+      r ^= r >> 16;
+      r *= 0x7FEB352Du;
+      r ^= r >> 15;
+      r *= 0x846CA68Bu;
+      r ^= r >> 16;
+      int k = 0;
+      for(int c = 0; c < 7; ++c) k += (r >= kCDF[c]);
+      w[u] = k;
+    }
+    return w;
+  }
+
+protected:
+  uint64_t fSeed;
+  std::vector<float> fWeights;
+};
+
+/*
+ Bin contents of every universe of one histogram. Stored bin-major, so a fill
+ adds one contiguous run of weights. Bins are numbered as in TH1, 0 and
+ nBins+1 being under- and overflow.
+ */
+class BootstrapHist
+{
+public:
+  BootstrapHist(int nBins, int nUniv) : fNBins(nBins), fNUniv(nUniv), fCounts((nBins+2) * nUniv, 0) {}
+
+  void Fill(int bin, const float* weights)
+  {
+    double* c = &fCounts[bin * fNUniv];
+    for(int u = 0; u < fNUniv; ++u) c[u] += weights[u];
+  }
+
+  void Add(const BootstrapHist& rhs)
+  {
+    for(size_t i = 0; i < fCounts.size(); ++i) fCounts[i] += rhs.fCounts[i];
+  }
+
+  void SaveTo(TDirectory* dir, const std::string& name) const
+  {
+    TVectorD v(fCounts.size(), fCounts.data());
+    dir->WriteTObject(&v, name.c_str());
+  }
+
+  void AddFrom(TDirectory* dir, const std::string& name)
+  {
+    const TVectorD* v = (TVectorD*)dir->Get(name.c_str());
+    const double* c = v->GetMatrixArray();
+    for(size_t i = 0; i < fCounts.size(); ++i) fCounts[i] += c[i];
+    delete v;
+  }
+
+  double Count(int bin, int u) const { return fCounts[bin * fNUniv + u]; }
+
+  double Mean(int bin) const
+  {
+    double sum = 0;
+    for(int u = 0; u < fNUniv; ++u) sum += Count(bin, u);
+    return sum / fNUniv;
+  }
+
+  double RMS(int bin) const
+  {
+    const double mean = Mean(bin);
+    double sum = 0;
+    for(int u = 0; u < fNUniv; ++u) sum += (Count(bin, u) - mean) * (Count(bin, u) - mean);
+    return fNUniv > 1 ? sqrt(sum / (fNUniv-1)) : 0;
+  }
+
+  // The value below which a fraction q of the universes lie in bin
+  double Quantile(int bin, double q) const
+  {
+    std::vector<double> vals(fCounts.begin() + bin * fNUniv, fCounts.begin() + (bin+1) * fNUniv);
+    const int k = std::min(fNUniv-1, std::max(0, int(q * fNUniv)));
+    std::nth_element(vals.begin(), vals.begin() + k, vals.end());
+    return vals[k];
+  }
+
+  /*
+   nominal with the universe RMS as bin errors, and the (1-cl)/2 and (1+cl)/2
+   quantiles as separate histograms, all scaled by scale. The caller owns the
+   two new histograms.
+   */
+  void ToErrorBand(TH1* nominal, double scale, TH1*& lo, TH1*& hi, double cl = 0.68) const
+  {
+    lo = (TH1*)nominal->Clone((std::string(nominal->GetName()) + "_lo").c_str());
+    hi = (TH1*)nominal->Clone((std::string(nominal->GetName()) + "_hi").c_str());
+    lo->SetDirectory(0);
+    hi->SetDirectory(0);
+    for(int bin = 0; bin <= fNBins+1; ++bin){
+      nominal->SetBinError(bin, RMS(bin) * scale);
+      lo->SetBinContent(bin, Quantile(bin, (1-cl)/2) * scale);
+      hi->SetBinContent(bin, Quantile(bin, (1+cl)/2) * scale);
+      lo->SetBinError(bin, 0);
+      hi->SetBinError(bin, 0);
+    }
+  }
+
+  // Bin-to-bin covariance over the universes, in-range bins only, times scale^2
+  TH2D* Covariance(const std::string& name, double scale) const
+  {
+    TH2D* h = new TH2D(name.c_str(), ";Bin;Bin", fNBins, 0.5, fNBins+.5, fNBins, 0.5, fNBins+.5);
+    h->SetDirectory(0);
+    std::vector<double> mean(fNBins+2);
+    for(int bin = 1; bin <= fNBins; ++bin) mean[bin] = Mean(bin);
+    for(int a = 1; a <= fNBins; ++a){
+      for(int b = a; b <= fNBins; ++b){
+        const double* ca = &fCounts[a * fNUniv];
+        const double* cb = &fCounts[b * fNUniv];
+        double sum = 0;
+        for(int u = 0; u < fNUniv; ++u) sum += (ca[u] - mean[a]) * (cb[u] - mean[b]);
+        const double cov = fNUniv > 1 ? sum / (fNUniv-1) * scale * scale : 0;
+        h->SetBinContent(a, b, cov);
+        h->SetBinContent(b, a, cov);
+      }
+    }
+    return h;
+  }
+
+protected:
+  int fNBins, fNUniv;
+  // [bin * fNUniv + universe]. Double, as the weights are integers and float
+  // would stop counting them exactly past 2^24 in a bin.
+  std::vector<double> fCounts;
+};
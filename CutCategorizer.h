@@ -0,0 +1,383 @@
+#pragma once
+
+// Evaluates every distinct Cut once per event into a bitmask, and fills any
+// number of histograms from that mask. Registering a spectrum costs a mask
+// comparison per event, not another pass through its cuts.
+
+#include "CAFAna/Core/SpectrumLoader.h"
+#include "CAFAna/Core/Spectrum.h"
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Core/HistAxis.h"
+#include "CAFAna/Core/Cut.h"
+#include "CAFAna/Core/Var.h"
+#include "StandardRecord/SRProxy.h" // A wrapper for the CAF format
+#include "TH1.h" // 1-dimensional histogram
+#include "TH2.h" // 2-dimensional histogram
+#include "TDirectory.h"
+#include "TParameter.h"
+#include "Bootstrap.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Which cut bits must be set (on) and which must be clear (off)
+struct Selection
+{
+  uint64_t on = 0;
+  uint64_t off = 0;
+
+  bool Pass(uint64_t mask) const { return (mask & on) == on && (mask & off) == 0; }
+};
+
+class CutCategorizer;
+
+/*
+ Anything that wants every event along with its cut mask, e.g. ResponseEngine.
+ The rest of the interface lets partial results (one file's worth) be saved,
+ reloaded and summed by CutCategorizer.
+ */
+class IEventSink
+{
+public:
+  virtual ~IEventSink() {}
+  virtual void Fill(CutCategorizer& cat, const caf::SRProxy* sr, uint64_t mask) = 0;
+
+  // rhs is always a sink of the same type and definition
+  virtual void Add(const IEventSink& rhs) = 0;
+  virtual void SaveTo(TDirectory* dir) const = 0;
+  virtual void AddFrom(TDirectory* dir) = 0;
+  // Everything about the sink's setup that changes its output, as text
+  virtual std::string Definition() const = 0;
+};
+
+class CutCategorizer
+{
+public:
+  CutCategorizer() {}
+  // The loader holds a pointer to us
+  CutCategorizer(const CutCategorizer&) = delete;
+  CutCategorizer& operator=(const CutCategorizer&) = delete;
+
+  /*
+   Gives every 1D spectrum and stack category added after this nUniv Poisson
+   bootstrap universes (Bootstrap.h), read back with Universes(). The weights
+   are drawn once per event and shared by all spectra.
+   */
+  void SetUniverses(int nUniv, uint64_t seed = 0)
+  {
+    fUniverses.reset(nUniv > 0 ? new PoissonUniverses(nUniv, seed) : 0);
+  }
+
+  // Events must pass all of require and none of veto. Cuts are shared by ID,
+  // so pass kIsAntiNu as a veto rather than !kIsAntiNu as a requirement.
+  Selection Select(const std::vector<ana::Cut>& require, const std::vector<ana::Cut>& veto = {})
+  {
+    Selection sel;
+    for(const ana::Cut& c: require) sel.on |= CutBit(c);
+    for(const ana::Cut& c: veto) sel.off |= CutBit(c);
+    return sel;
+  }
+
+  // Returns the index to pass to ToHist()
+  int AddSpectrum(const std::string& name, const ana::HistAxis& ax, const Selection& sel)
+  {
+    const ana::Binning& bins = ax.GetBinnings()[0];
+    Entry e;
+    e.name = name;
+    e.sel = sel;
+    e.varX = VarSlot(ax.GetVars()[0]);
+    e.hist.reset(new TH1D(UniqueName().c_str(), (";"+ax.GetLabels()[0]).c_str(), bins.NBins(), &bins.Edges()[0]));
+    e.hist->SetDirectory(0);
+    if(fUniverses) e.boot.reset(new BootstrapHist(bins.NBins(), fUniverses->NUniverses()));
+    fEntries.push_back(std::move(e));
+    return fEntries.size()-1;
+  }
+
+  int AddSpectrum(const std::string& name, const ana::HistAxis& axX, const ana::HistAxis& axY, const Selection& sel)
+  {
+    const ana::Binning& binsX = axX.GetBinnings()[0];
+    const ana::Binning& binsY = axY.GetBinnings()[0];
+    Entry e;
+    e.name = name;
+    e.sel = sel;
+    e.varX = VarSlot(axX.GetVars()[0]);
+    e.varY = VarSlot(axY.GetVars()[0]);
+    e.hist.reset(new TH2D(UniqueName().c_str(), (";"+axX.GetLabels()[0]+";"+axY.GetLabels()[0]).c_str(),
+                          binsX.NBins(), &binsX.Edges()[0], binsY.NBins(), &binsY.Edges()[0]));
+    e.hist->SetDirectory(0);
+    fEntries.push_back(std::move(e));
+    return fEntries.size()-1;
+  }
+
+  /*
+   Mutually exclusive categories (e.g. interaction mode) of the same axis. index
+   returns the category of an event, 0 to labels.size()-1, or anything else for
+   none. One fill per event into an energy x category histogram, instead of one
+   spectrum and one cut per category. Returns the index of the first category;
+   the others follow in order, named name/label.
+   */
+  int AddStack(const std::string& name, const ana::HistAxis& ax, const ana::Var& index,
+               const std::vector<std::string>& labels, const Selection& sel)
+  {
+    const ana::Binning& bins = ax.GetBinnings()[0];
+    Stack s;
+    s.sel = sel;
+    s.varX = VarSlot(ax.GetVars()[0]);
+    s.varIndex = VarSlot(index);
+    s.hist.reset(new TH2D(UniqueName().c_str(), (";"+ax.GetLabels()[0]).c_str(),
+                          bins.NBins(), &bins.Edges()[0], int(labels.size()), 0, labels.size()));
+    s.hist->SetDirectory(0);
+    s.first = fEntries.size();
+    if(fUniverses)
+      for(size_t i = 0; i < labels.size(); ++i) s.boot.emplace_back(bins.NBins(), fUniverses->NUniverses());
+    // Placeholder entries so the categories are addressed like any other spectrum
+    for(const std::string& label: labels){
+      Entry e;
+      e.name = name + "/" + label;
+      e.stack = fStacks.size();
+      fEntries.push_back(std::move(e));
+    }
+    fStacks.push_back(std::move(s));
+    return fEntries.size() - labels.size();
+  }
+
+  // sink is called for every event after the spectra are filled. Not owned.
+  void AddSink(IEventSink* sink) { fSinks.push_back(sink); }
+
+  // For sinks: register a Var at setup, then read its per-event cached value
+  int VarSlot(const ana::Var& var)
+  {
+    for(size_t i = 0; i < fVars.size(); ++i) if(fVars[i].ID() == var.ID()) return i;
+    fVars.push_back(var);
+    fVarVals.push_back(0);
+    fVarEvent.push_back(0);
+    return fVars.size()-1;
+  }
+
+  // Each Var is evaluated at most once per event, and only if something needs it
+  double VarValue(int slot, const caf::SRProxy* sr)
+  {
+    if(fVarEvent[slot] != fEvent){
+      fVarVals[slot] = fVars[slot](sr);
+      fVarEvent[slot] = fEvent;
+    }
+    return fVarVals[slot];
+  }
+
+  // Hooks us up to loader. Call once, after everything is added.
+  void Register(ana::SpectrumLoaderBase& loader)
+  {
+    // A Cut that never passes but sees every event once. Its Spectrum stays
+    // empty, but counts the POT of everything the loader reads.
+    const ana::Cut kTap([this](const caf::SRProxy* sr){ HandleEvent(sr); return false; });
+    const ana::Var kZero([](const caf::SRProxy*){ return 0.; });
+    fTap.reset(new ana::Spectrum(loader, ana::HistAxis("", ana::Binning::Simple(1, 0, 1), kZero), kTap));
+  }
+
+  double POT() const { return (fTap ? fTap->POT() : 0) + fAddedPOT; }
+
+  /*
+   Sums rhs into us, POT included. rhs must have been set up by the same code,
+   i.e. have the same Definition().
+   */
+  void Add(const CutCategorizer& rhs)
+  {
+    for(size_t i = 0; i < fEntries.size(); ++i){
+      if(fEntries[i].hist) fEntries[i].hist->Add(rhs.fEntries[i].hist.get());
+      if(fEntries[i].boot) fEntries[i].boot->Add(*rhs.fEntries[i].boot);
+    }
+    for(size_t i = 0; i < fStacks.size(); ++i){
+      fStacks[i].hist->Add(rhs.fStacks[i].hist.get());
+      for(size_t c = 0; c < fStacks[i].boot.size(); ++c) fStacks[i].boot[c].Add(rhs.fStacks[i].boot[c]);
+    }
+    for(size_t k = 0; k < fSinks.size(); ++k) fSinks[k]->Add(*rhs.fSinks[k]);
+    fAddedPOT += rhs.POT();
+  }
+
+  // Raw (un-normalised) contents and POT, for AddFrom() to read back
+  void SaveTo(TDirectory* dir) const
+  {
+    for(size_t i = 0; i < fEntries.size(); ++i){
+      if(fEntries[i].hist) dir->WriteTObject(fEntries[i].hist.get(), ("hist_"+std::to_string(i)).c_str());
+      if(fEntries[i].boot) fEntries[i].boot->SaveTo(dir, "boot_"+std::to_string(i));
+    }
+    for(size_t i = 0; i < fStacks.size(); ++i){
+      dir->WriteTObject(fStacks[i].hist.get(), ("stack_"+std::to_string(i)).c_str());
+      for(size_t c = 0; c < fStacks[i].boot.size(); ++c)
+        fStacks[i].boot[c].SaveTo(dir, "stackboot_"+std::to_string(i)+"_"+std::to_string(c));
+    }
+    for(size_t k = 0; k < fSinks.size(); ++k) fSinks[k]->SaveTo(dir->mkdir(("sink_"+std::to_string(k)).c_str()));
+    TParameter<double> pot("pot", POT());
+    dir->WriteTObject(&pot);
+  }
+
+  // Sums in what SaveTo() wrote
+  void AddFrom(TDirectory* dir)
+  {
+    for(size_t i = 0; i < fEntries.size(); ++i){
+      if(fEntries[i].hist) fEntries[i].hist->Add((TH1*)dir->Get(("hist_"+std::to_string(i)).c_str()));
+      if(fEntries[i].boot) fEntries[i].boot->AddFrom(dir, "boot_"+std::to_string(i));
+    }
+    for(size_t i = 0; i < fStacks.size(); ++i){
+      fStacks[i].hist->Add((TH1*)dir->Get(("stack_"+std::to_string(i)).c_str()));
+      for(size_t c = 0; c < fStacks[i].boot.size(); ++c)
+        fStacks[i].boot[c].AddFrom(dir, "stackboot_"+std::to_string(i)+"_"+std::to_string(c));
+    }
+    for(size_t k = 0; k < fSinks.size(); ++k) fSinks[k]->AddFrom(dir->GetDirectory(("sink_"+std::to_string(k)).c_str()));
+    TParameter<double>* pot = (TParameter<double>*)dir->Get("pot");
+    fAddedPOT += pot->GetVal();
+    delete pot;
+  }
+
+  /*
+   Names, selections, binnings, universes and sinks, as text. Two categorizers
+   with the same Definition() have interchangeable contents, as long as the
+   Cut and Var lambdas themselves did not change (ResultCache hashes their
+   source files for that).
+   */
+  std::string Definition() const
+  {
+    std::string def = "cuts " + std::to_string(fCuts.size()) + " vars " + std::to_string(fVars.size()) + "\n";
+    if(fUniverses) def += "universes " + std::to_string(fUniverses->NUniverses()) + " " + std::to_string(fUniverses->Seed()) + "\n";
+    for(const Entry& e: fEntries){
+      def += e.name + " " + std::to_string(e.sel.on) + " " + std::to_string(e.sel.off) + " "
+        + std::to_string(e.varX) + " " + std::to_string(e.varY) + " " + std::to_string(e.stack);
+      if(e.hist) def += AxisDefinition(e.hist->GetXaxis()) + AxisDefinition(e.hist->GetYaxis());
+      def += "\n";
+    }
+    for(const Stack& s: fStacks){
+      def += "stack " + std::to_string(s.sel.on) + " " + std::to_string(s.sel.off) + " "
+        + std::to_string(s.varX) + " " + std::to_string(s.varIndex) + AxisDefinition(s.hist->GetXaxis()) + "\n";
+    }
+    for(const IEventSink* sink: fSinks) def += sink->Definition() + "\n";
+    return def;
+  }
+
+  size_t NSpectra() const { return fEntries.size(); }
+  const std::string& Name(int i) const { return fEntries[i].name; }
+
+  // The bootstrap universes of spectrum i, null without SetUniverses() or for 2D spectra
+  const BootstrapHist* Universes(int i) const
+  {
+    const Entry& e = fEntries[i];
+    if(e.stack >= 0){
+      const Stack& s = fStacks[e.stack];
+      return s.boot.empty() ? 0 : &s.boot[i - s.first];
+    }
+    return e.boot.get();
+  }
+
+  // Spectrum i as a new histogram normalised to pot. The caller owns it.
+  TH1* ToHist(int i, double pot) const
+  {
+    const Entry& e = fEntries[i];
+    TH1* h;
+    if(e.stack >= 0){
+      const Stack& s = fStacks[e.stack];
+      const int bin = i - s.first + 1;
+      h = s.hist->ProjectionX(UniqueName().c_str(), bin, bin);
+    }
+    else{
+      h = (TH1*)e.hist->Clone(UniqueName().c_str());
+    }
+    h->SetDirectory(0);
+    if(POT() > 0) h->Scale(pot/POT());
+    return h;
+  }
+
+protected:
+  struct Entry
+  {
+    std::string name;
+    Selection sel;
+    int varX = -1;
+    int varY = -1; // Only for 2D spectra
+    int stack = -1; // Index in fStacks if this is a stack category
+    std::unique_ptr<TH1> hist;
+    std::unique_ptr<BootstrapHist> boot;
+  };
+
+  struct Stack
+  {
+    Selection sel;
+    int varX, varIndex;
+    int first; // Index of the first category in fEntries
+    std::unique_ptr<TH2> hist;
+    std::vector<BootstrapHist> boot; // One per category
+  };
+
+  uint64_t CutBit(const ana::Cut& cut)
+  {
+    for(size_t i = 0; i < fCuts.size(); ++i) if(fCuts[i].ID() == cut.ID()) return uint64_t(1) << i;
+    if(fCuts.size() == 64){
+      std::cout << "CutCategorizer: more than 64 distinct cuts" << std::endl;
+      abort();
+    }
+    fCuts.push_back(cut);
+    return uint64_t(1) << (fCuts.size()-1);
+  }
+
+  void HandleEvent(const caf::SRProxy* sr)
+  {
+    ++fEvent;
+    uint64_t mask = 0;
+    for(size_t i = 0; i < fCuts.size(); ++i) if(fCuts[i](sr)) mask |= uint64_t(1) << i;
+
+    // Poisson weights of this event in every universe, drawn on first use
+    const float* weights = 0;
+    auto Weights = [&](){
+      if(!weights) weights = fUniverses->Weights(EventKey(sr->run, sr->subrun, sr->event));
+      return weights;
+    };
+
+    for(Entry& e: fEntries){
+      if(e.stack >= 0 || !e.sel.Pass(mask)) continue;
+      if(e.varY < 0){
+        const int bin = e.hist->Fill(VarValue(e.varX, sr));
+        if(e.boot && bin >= 0) e.boot->Fill(bin, Weights());
+      }
+      else{
+        ((TH2*)e.hist.get())->Fill(VarValue(e.varX, sr), VarValue(e.varY, sr));
+      }
+    }
+    for(Stack& s: fStacks){
+      if(!s.sel.Pass(mask)) continue;
+      const double idx = VarValue(s.varIndex, sr);
+      if(idx < 0 || idx >= s.hist->GetNbinsY()) continue;
+      const double x = VarValue(s.varX, sr);
+      s.hist->Fill(x, idx);
+      if(!s.boot.empty()) s.boot[int(idx)].Fill(s.hist->GetXaxis()->FindFixBin(x), Weights());
+    }
+    for(IEventSink* sink: fSinks) sink->Fill(*this, sr, mask);
+  }
+
+  std::string UniqueName() const
+  {
+    static std::atomic<int> counter(0);
+    return "cutcategorizer_" + std::to_string(counter++);
+  }
+
+  static std::string AxisDefinition(const TAxis* ax)
+  {
+    std::string def;
+    for(int i = 1; i <= ax->GetNbins()+1; ++i) def += " " + std::to_string(ax->GetBinLowEdge(i));
+    return def;
+  }
+
+  std::vector<ana::Cut> fCuts;
+  std::vector<ana::Var> fVars;
+  std::vector<double> fVarVals;
+  std::vector<uint64_t> fVarEvent; // fEvent when fVarVals was last filled
+  uint64_t fEvent = 0;
+
+  std::vector<Entry> fEntries;
+  std::vector<Stack> fStacks;
+  std::vector<IEventSink*> fSinks;
+  std::unique_ptr<PoissonUniverses> fUniverses;
+  std::unique_ptr<ana::Spectrum> fTap;
+  double fAddedPOT = 0; // From Add() and AddFrom()
+};
@@ -0,0 +1,319 @@
+#pragma once
+
+// Fill each Var once at fine resolution, bin it later. Any coarser binning,
+// sub-range or 2D projection (the true-vs-reco matrix included) is derived from
+// the stored cells without rereading the CAFs.
+
+#include "TH1.h" // 1-dimensional histogram
+#include "TH2.h" // 2-dimensional histogram
+#include "TDirectory.h"
+#include "TVectorD.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "CutCategorizer.h"
+#include "ResponseMatrix.h"
+
+/*
+ Cuts an axis into n cells of width step from lo. Cell codes are 1..n in
+ range, 0 below, n+1 above. NaN goes above too, which is where TH1::Fill puts
+ it. A value on a cell edge is in the cell above, as in TAxis::FindBin.
+ */
+struct Quantizer
+{
+  double lo, step;
+  int n; // At most 65533, so a code fits in 16 bits
+
+  double Hi() const { return lo + n * step; }
+
+  // Lower edge of cell code k+1, computed as Binning::Simple(n, lo, Hi())
+  // computes its edges, so bin edges on the grid are the same doubles
+  double Edge(int k) const { return lo + k * (Hi() - lo) / n; }
+
+  int Code(double x) const
+  {
+    if(x < lo) return 0;
+    if(!(x < Hi())) return n+1;
+    // The division can round across an edge (2.3/.005 is 459.99...), so
+    // check against the edges themselves
+    int k = std::min(n-1, int(std::floor((x - lo) / step)));
+    if(x < Edge(k)) --k;
+    else if(k+1 < n && x >= Edge(k+1)) ++k;
+    return 1 + k;
+  }
+
+  // Centre of cell code, just outside the range for under- and overflow
+  double Centre(int code) const { return lo + (code - .5) * step; }
+};
+
+/*
+ Counts per occupied cell of up to three quantized axes, as (key, count) pairs
+ sorted by key, the key being the cell codes packed 16 bits each. Fills go to a
+ pending list first, which is sorted and merged in once it is as long as the
+ cell list, so filling is amortised O(log n) and memory is bounded by the
+ number of occupied cells, whatever the number of events.
+
+ Derived histograms assign each cell by its centre. They agree exactly with
+ filling directly when the bin edges lie on the cell grid (multiples of step
+ from lo, as Binning::Simple makes them), otherwise to within one cell width.
+ */
+class QuantizedStore
+{
+public:
+  QuantizedStore(const std::vector<Quantizer>& axes) : fAxes(axes)
+  {
+    if(axes.empty() || axes.size() > 3){
+      std::cout << "QuantizedStore: 1 to 3 axes, not " << axes.size() << std::endl;
+      abort();
+    }
+  }
+
+  size_t NAxes() const { return fAxes.size(); }
+  const Quantizer& Axis(int a) const { return fAxes[a]; }
+
+  void Fill(const double* x, double weight = 1)
+  {
+    uint64_t key = 0;
+    for(size_t a = 0; a < fAxes.size(); ++a) key |= uint64_t(fAxes[a].Code(x[a])) << (16*a);
+    fPending.emplace_back(key, weight);
+    if(fPending.size() >= std::max(kMinPending, fCells.size())) Compact();
+  }
+
+  void Add(const QuantizedStore& rhs)
+  {
+    fPending.insert(fPending.end(), rhs.fCells.begin(), rhs.fCells.end());
+    fPending.insert(fPending.end(), rhs.fPending.begin(), rhs.fPending.end());
+    Compact();
+  }
+
+  // Keys and counts, for AddFrom() to read back. Keys of up to 48 bits are exact in a double.
+  void SaveTo(TDirectory* dir, const std::string& name) const
+  {
+    const std::vector<std::pair<uint64_t, double>> cells = Merged();
+    std::vector<double> keys(cells.size()), counts(cells.size());
+    for(size_t i = 0; i < cells.size(); ++i){
+      keys[i] = cells[i].first;
+      counts[i] = cells[i].second;
+    }
+    TVectorD k(keys.size(), keys.data());
+    TVectorD c(counts.size(), counts.data());
+    dir->WriteTObject(&k, (name+"_keys").c_str());
+    dir->WriteTObject(&c, (name+"_counts").c_str());
+  }
+
+  void AddFrom(TDirectory* dir, const std::string& name)
+  {
+    const TVectorD* k = (TVectorD*)dir->Get((name+"_keys").c_str());
+    const TVectorD* c = (TVectorD*)dir->Get((name+"_counts").c_str());
+    for(int i = 0; i < k->GetNrows(); ++i) fPending.emplace_back(uint64_t((*k)[i]), (*c)[i]);
+    delete k;
+    delete c;
+    Compact();
+  }
+
+  std::string Definition() const
+  {
+    std::string def = "quantized";
+    for(const Quantizer& q: fAxes) def += " " + std::to_string(q.lo) + " " + std::to_string(q.step) + " " + std::to_string(q.n);
+    return def;
+  }
+
+  size_t NCells() const { return fCells.size() + fPending.size(); }
+  size_t MemoryBytes() const { return (fCells.capacity() + fPending.capacity()) * sizeof(fCells[0]); }
+
+  // Axis a summed over the others, binned with edges (any spacing, any sub-range). The caller owns it.
+  TH1D* Project1D(const std::string& name, const std::string& title, int a, const std::vector<double>& edges) const
+  {
+    TH1D* h = new TH1D(name.c_str(), title.c_str(), edges.size()-1, &edges[0]);
+    h->SetDirectory(0);
+    const std::vector<int> bins = BinOfCode(a, edges);
+    std::vector<double> sum(edges.size()+1, 0);
+    auto Accumulate = [&](const std::pair<uint64_t, double>& cell){ sum[bins[Code(cell.first, a)]] += cell.second; };
+    for(const auto& cell: fCells) Accumulate(cell);
+    for(const auto& cell: fPending) Accumulate(cell);
+    for(size_t bin = 0; bin < sum.size(); ++bin) h->SetBinContent(bin, sum[bin]);
+    return h;
+  }
+
+  // Axis ax against axis ay, summed over any third. The caller owns it.
+  TH2D* Project2D(const std::string& name, const std::string& title, int ax, int ay,
+                  const std::vector<double>& xEdges, const std::vector<double>& yEdges) const
+  {
+    TH2D* h = new TH2D(name.c_str(), title.c_str(), xEdges.size()-1, &xEdges[0], yEdges.size()-1, &yEdges[0]);
+    h->SetDirectory(0);
+    const std::vector<int> xBins = BinOfCode(ax, xEdges);
+    const std::vector<int> yBins = BinOfCode(ay, yEdges);
+    const size_t nx = xEdges.size()+1;
+    std::vector<double> sum(nx * (yEdges.size()+1), 0);
+    auto Accumulate = [&](const std::pair<uint64_t, double>& cell){
+      sum[yBins[Code(cell.first, ay)] * nx + xBins[Code(cell.first, ax)]] += cell.second;
+    };
+    for(const auto& cell: fCells) Accumulate(cell);
+    for(const auto& cell: fPending) Accumulate(cell);
+    for(size_t by = 0; by <= yEdges.size(); ++by)
+      for(size_t bx = 0; bx < nx; ++bx)
+        if(sum[by * nx + bx] != 0) h->SetBinContent(bx, by, sum[by * nx + bx]);
+    return h;
+  }
+
+  // The response of axis aReco to axis aTrue, with any binning. Call Finalize() on it before folding.
+  ResponseMatrix ToResponse(const std::vector<double>& trueEdges, const std::vector<double>& recoEdges,
+                            int aTrue = 0, int aReco = 1) const
+  {
+    BinOfCode(aTrue, trueEdges); // Only for the grid warnings
+    BinOfCode(aReco, recoEdges);
+    ResponseMatrix m(trueEdges, recoEdges);
+    auto Accumulate = [&](const std::pair<uint64_t, double>& cell){
+      m.Fill(fAxes[aTrue].Centre(Code(cell.first, aTrue)), fAxes[aReco].Centre(Code(cell.first, aReco)), cell.second);
+    };
+    for(const auto& cell: fCells) Accumulate(cell);
+    for(const auto& cell: fPending) Accumulate(cell);
+    return m;
+  }
+
+protected:
+  static constexpr size_t kMinPending = 1 << 16;
+
+  static int Code(uint64_t key, int a) { return (key >> (16*a)) & 0xFFFF; }
+
+  // fCells and fPending as one sorted list with no repeated keys
+  std::vector<std::pair<uint64_t, double>> Merged() const
+  {
+    std::vector<std::pair<uint64_t, double>> pending = fPending;
+    std::sort(pending.begin(), pending.end(),
+              [](const std::pair<uint64_t, double>& a, const std::pair<uint64_t, double>& b){ return a.first < b.first; });
+    std::vector<std::pair<uint64_t, double>> ret;
+    ret.reserve(fCells.size() + pending.size());
+    size_t i = 0, j = 0;
+    while(i < fCells.size() || j < pending.size()){
+      const bool fromCells = j == pending.size() || (i < fCells.size() && fCells[i].first <= pending[j].first);
+      const std::pair<uint64_t, double>& next = fromCells ? fCells[i++] : pending[j++];
+      if(!ret.empty() && ret.back().first == next.first) ret.back().second += next.second;
+      else ret.push_back(next);
+    }
+    return ret;
+  }
+
+  void Compact()
+  {
+    fCells = Merged();
+    fPending.clear();
+  }
+
+  /*
+   For every code of axis a, its bin in edges as TH1 numbers it (0 and
+   edges.size() for under- and overflow). Warns about edges that don't fall
+   on the cell grid, or that reach past the stored range.
+   */
+  std::vector<int> BinOfCode(int a, const std::vector<double>& edges) const
+  {
+    const Quantizer& q = fAxes[a];
+    for(double e: edges){
+      const double cells = (e - q.lo) / q.step;
+      if(e < q.lo || e > q.Hi()){
+        std::cout << "QuantizedStore: edge " << e << " is outside the stored range "
+                  << q.lo << "-" << q.Hi() << ", those events are in under/overflow" << std::endl;
+        break;
+      }
+      if(fabs(cells - std::round(cells)) > 1e-6){
+        std::cout << "QuantizedStore: edge " << e << " is not a multiple of " << q.step
+                  << " from " << q.lo << ", cells are binned by their centre" << std::endl;
+        break;
+      }
+    }
+
+    const int nBins = edges.size()-1;
+    std::vector<int> bins(q.n+2);
+    bins[0] = 0;
+    bins[q.n+1] = nBins+1;
+    for(int c = 1; c <= q.n; ++c)
+      bins[c] = std::upper_bound(edges.begin(), edges.end(), q.Centre(c)) - edges.begin(); // 0 below, nBins+1 above
+    return bins;
+  }
+
+  std::vector<Quantizer> fAxes;
+  std::vector<std::pair<uint64_t, double>> fCells; // Sorted by key, no repeats
+  std::vector<std::pair<uint64_t, double>> fPending; // Not yet merged into fCells
+};
+
+/*
+ CutCategorizer sink holding one QuantizedStore per registered set of Vars and
+ Selection, e.g. true energy for each mode, or true vs reco energy for the
+ smearing matrices. One pass over the CAFs, then any number of binnings.
+ */
+class MasterHists: public IEventSink
+{
+public:
+  MasterHists(CutCategorizer& cat) : fCat(&cat) {}
+
+  // vars and axes pair up, 1 to 3 of them. Returns the index to pass to Store().
+  int Add(const std::string& name, const std::vector<ana::Var>& vars, const std::vector<Quantizer>& axes,
+          const Selection& sel = Selection())
+  {
+    Entry e;
+    e.name = name;
+    e.sel = sel;
+    for(const ana::Var& v: vars) e.slots.push_back(fCat->VarSlot(v));
+    e.store.reset(new QuantizedStore(axes));
+    fEntries.push_back(std::move(e));
+    return fEntries.size()-1;
+  }
+
+  void Fill(CutCategorizer& cat, const caf::SRProxy* sr, uint64_t mask) override
+  {
+    double x[3];
+    for(Entry& e: fEntries){
+      if(!e.sel.Pass(mask)) continue;
+      for(size_t a = 0; a < e.slots.size(); ++a) x[a] = cat.VarValue(e.slots[a], sr);
+      e.store->Fill(x);
+    }
+  }
+
+  void Add(const IEventSink& rhs) override
+  {
+    const MasterHists& r = dynamic_cast<const MasterHists&>(rhs);
+    for(size_t i = 0; i < fEntries.size(); ++i) fEntries[i].store->Add(*r.fEntries[i].store);
+  }
+
+  void SaveTo(TDirectory* dir) const override
+  {
+    for(size_t i = 0; i < fEntries.size(); ++i) fEntries[i].store->SaveTo(dir, "store_"+std::to_string(i));
+  }
+
+  void AddFrom(TDirectory* dir) override
+  {
+    for(size_t i = 0; i < fEntries.size(); ++i) fEntries[i].store->AddFrom(dir, "store_"+std::to_string(i));
+  }
+
+  std::string Definition() const override
+  {
+    std::string def = "MasterHists";
+    for(const Entry& e: fEntries){
+      def += "\n" + e.name + " " + std::to_string(e.sel.on) + " " + std::to_string(e.sel.off);
+      for(int s: e.slots) def += " " + std::to_string(s);
+      def += " " + e.store->Definition();
+    }
+    return def;
+  }
+
+  size_t NStores() const { return fEntries.size(); }
+  const std::string& Name(int i) const { return fEntries[i].name; }
+  const QuantizedStore& Store(int i) const { return *fEntries[i].store; }
+
+protected:
+  struct Entry
+  {
+    std::string name;
+    Selection sel;
+    std::vector<int> slots; // CutCategorizer Var slots, one per axis
+    std::unique_ptr<QuantizedStore> store;
+  };
+
+  CutCategorizer* fCat;
+  std::vector<Entry> fEntries;
+};
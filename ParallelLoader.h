@@ -0,0 +1,375 @@
+#pragma once
+
+// Runs a SpectrumLoader per input file on a pool of threads and merges the
+// per-file results in file order, so the output is bit-for-bit the same for
+// any number of threads.
+
+#include "CAFAna/Core/SpectrumLoader.h"
+#include "CAFAna/Core/Spectrum.h"
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Core/HistAxis.h"
+#include "CAFAna/Core/Cut.h"
+#include "CAFAna/Core/Var.h"
+#include "CAFAna/Core/Utilities.h" // Wildcard
+#include "StandardRecord/SRProxy.h" // A wrapper for the CAF format
+#include "TFile.h"
+#include "TROOT.h"
+#include "TSystem.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// CAFAna hands out Var/Cut/Binning IDs without locking, so anything that
+// constructs them off the main thread holds this
+inline std::mutex& DefineMutex()
+{
+  static std::mutex m;
+  return m;
+}
+
+/*
+ Adds the exposure of part to total. Spectrum::operator+= scales rhs to our
+ POT, which is right for combining predictions of the same data but not for
+ adding more files, so add the raw contents with both POTs set to 1 and then
+ set the sum.
+ */
+inline void AddExposure(ana::Spectrum& total, const ana::Spectrum& part)
+{
+  const double pot = total.POT() + part.POT();
+  ana::Spectrum p(part);
+  total.OverridePOT(1);
+  p.OverridePOT(1);
+  total += p;
+  total.OverridePOT(pot);
+}
+
+struct FileStats
+{
+  std::string file;
+  long long size = 0; // On disk
+  long events = 0;
+  double seconds = 0;
+  size_t input = 0; // Which of the wildcards it came from
+  int thread = -1;
+  bool cached = false; // Came from Shortcut() without being read
+};
+
+/*
+ T is whatever holds one file's results: typically a struct whose constructor
+ makes the same Spectrum(loader, axis, cut) registrations a macro would. The
+ define function builds one against the loader it is given; merge adds a
+ part into the total.
+
+ Files are handed out in file-name order, each to whichever thread is free
+ next. Each file gets its own loader and its own T, so threads never share
+ histograms. Finished parts are merged in file-name order as soon as all
+ earlier files are done. Until then they wait in memory, so a thread only
+ starts a file less than MaxAhead() files after the oldest one not yet
+ merged: at most that many parts exist at once however many files there are.
+ One slow file stalls the others once they are that far ahead of it.
+
+ Files are the smallest unit of work: CAFAna's loader can't read part of one.
+
+ Given several wildcards (e.g. one per sample), all their files go through the
+ same pool, the first wildcard's files first, and GoAll() returns one total
+ per wildcard. Threads move on to the next wildcard's files as soon as the
+ previous one's are all handed out, rather than each input having threads of
+ its own that sit idle once it runs out.
+
+ The five single-plot macros' registrations work as they are, moved into a
+ struct:
+
+   struct Reco
+   {
+     Reco(SpectrumLoaderBase& loader) : sEQE(loader, axEQE, kHasQEFinalState) {}
+     Spectrum sEQE;
+   };
+   ParallelLoader<Reco> pl(NDLAR_RHC);
+   std::unique_ptr<Reco> r = pl.Go([](SpectrumLoaderBase& l){ return new Reco(l); },
+                                   [](Reco& tot, Reco& part){ AddExposure(tot.sEQE, part.sEQE); });
+ */
+template<class T> class ParallelLoader
+{
+public:
+  typedef std::function<T*(ana::SpectrumLoaderBase& loader)> DefineFunc;
+  typedef std::function<void(T& total, T& part)> MergeFunc;
+
+  // nThreads 0 means one per core
+  ParallelLoader(const std::string& wildcard, int nThreads = 0)
+    : ParallelLoader(std::vector<std::string>(1, wildcard), nThreads)
+  {
+  }
+
+  ParallelLoader(const std::vector<std::string>& wildcards, int nThreads = 0)
+    : fNInputs(wildcards.size()), fNThreads(nThreads > 0 ? nThreads : std::max(1u, std::thread::hardware_concurrency()))
+  {
+    for(size_t w = 0; w < wildcards.size(); ++w){
+      std::vector<std::string> files = ana::Wildcard(wildcards[w]);
+      std::sort(files.begin(), files.end());
+      fFiles.insert(fFiles.end(), files.begin(), files.end());
+      fInputs.insert(fInputs.end(), files.size(), w);
+    }
+  }
+
+  /*
+   Optional. tryCached is called for every file before reading it; a non-null
+   result is used as that file's part as is. afterRead is called with every
+   part that was actually read. Together they let ResultCache skip files.
+   Both run on the worker threads; tryCached must take DefineMutex() itself
+   around anything that makes or destroys Vars, Cuts, Binnings or Spectra.
+   */
+  void Shortcut(const std::function<T*(const std::string& file)>& tryCached,
+                const std::function<void(const std::string& file, const T& part)>& afterRead)
+  {
+    fTryCached = tryCached;
+    fAfterRead = afterRead;
+  }
+
+  // Seconds between progress lines while Go() runs, 0 for none
+  void SetReportInterval(double seconds) { fReportInterval = seconds; }
+  // Prefix of the progress lines
+  void SetLabel(const std::string& label) { fLabel = label; }
+  // Most files in flight, read or waiting to be merged. 0 means twice the threads.
+  void SetMaxAhead(size_t n) { fMaxAhead = n; }
+  size_t MaxAhead() const { return fMaxAhead > 0 ? fMaxAhead : 2 * size_t(fNThreads); }
+
+  // Reads every file and returns the merged result, built with define(kNullLoader)
+  std::unique_ptr<T> Go(const DefineFunc& define, const MergeFunc& merge)
+  {
+    if(fNInputs != 1){
+      std::cout << "ParallelLoader: Go() with " << fNInputs << " wildcards, use GoAll()" << std::endl;
+      abort();
+    }
+    return std::move(GoAll(define, merge)[0]);
+  }
+
+  // As Go(), with one total per wildcard, in the order they were given
+  std::vector<std::unique_ptr<T>> GoAll(const DefineFunc& define, const MergeFunc& merge)
+  {
+    ROOT::EnableThreadSafety();
+
+    std::vector<std::unique_ptr<T>> totals(fNInputs);
+    {
+      std::lock_guard<std::mutex> lock(DefineMutex());
+      for(std::unique_ptr<T>& total: totals) total.reset(define(ana::kNullLoader));
+    }
+
+    fStats.assign(fFiles.size(), FileStats());
+    for(size_t i = 0; i < fFiles.size(); ++i){
+      fStats[i].file = fFiles[i];
+      fStats[i].input = fInputs[i];
+      FileStat_t st;
+      if(gSystem->GetPathInfo(fFiles[i].c_str(), st) == 0) fStats[i].size = st.fSize;
+    }
+    fParts.clear();
+    fParts.resize(fFiles.size());
+    fNextStart = 0;
+    fNextMerge = 0;
+    fNDone = 0;
+    fEvents = std::vector<Counter>(fNThreads); // Not movable, so no resize()
+    fBytesAtStart = TFile::GetFileBytesRead();
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for(int t = 0; t < fNThreads; ++t)
+      workers.emplace_back([this, t, &define, &merge, &totals](){ Work(t, define, merge, totals); });
+
+    // Progress reports until the workers are all done. Every finished file
+    // wakes this up, so only report once the interval is really over.
+    {
+      const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(fReportInterval));
+      auto nextReport = start + interval;
+      std::unique_lock<std::mutex> lock(fDoneMutex);
+      while(fNDone < fFiles.size()){
+        if(fReportInterval > 0){
+          fDoneCond.wait_until(lock, nextReport);
+          if(std::chrono::steady_clock::now() >= nextReport){
+            Report(start, std::cout);
+            nextReport += interval;
+          }
+        }
+        else{
+          fDoneCond.wait(lock);
+        }
+      }
+    }
+    for(std::thread& w: workers) w.join();
+
+    fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fTotalEvents = Events();
+    fTotalBytes = BytesRead();
+    return totals;
+  }
+
+  const std::vector<FileStats>& Stats() const { return fStats; }
+
+  // Throughput and per-file latency of the last Go()
+  void Summary(std::ostream& os = std::cout) const
+  {
+    std::vector<double> lat;
+    size_t nCached = 0;
+    for(const FileStats& s: fStats){
+      if(s.cached) ++nCached;
+      else lat.push_back(s.seconds);
+    }
+    os << fLabel << ": " << fFiles.size() << " files (" << nCached << " cached) on " << fNThreads << " threads in " << fSeconds << " s: "
+       << fTotalEvents/fSeconds << " events/s, " << fTotalBytes/fSeconds/1e6 << " MB/s read" << std::endl;
+    if(lat.empty()) return;
+
+    std::sort(lat.begin(), lat.end());
+    os << "Per-file latency: min " << lat.front() << " s, median " << lat[lat.size()/2]
+       << " s, max " << lat.back() << " s" << std::endl;
+    for(const FileStats& s: fStats){
+      if(!s.cached && s.seconds == lat.back())
+        os << "Slowest: " << s.file << ", " << s.events << " events, " << s.size/1e6 << " MB on disk" << std::endl;
+    }
+  }
+
+protected:
+  // A loader and what was registered with it. result is declared second so it
+  // goes first, while its loader still exists.
+  struct Part
+  {
+    std::unique_ptr<ana::SpectrumLoader> loader;
+    std::unique_ptr<T> result;
+  };
+
+  // One per thread, a cache line each so the counting doesn't contend
+  struct alignas(64) Counter
+  {
+    std::atomic<long> n{0};
+  };
+
+  // The next file in order, once it is within MaxAhead() of the merge. False when none are left.
+  bool Take(size_t& item)
+  {
+    std::unique_lock<std::mutex> lock(fMergeMutex);
+    // Whoever holds fNextMerge is never waiting here, so this always ends
+    fAheadCond.wait(lock, [this](){ return fNextStart >= fFiles.size() || fNextStart < fNextMerge + MaxAhead(); });
+    if(fNextStart >= fFiles.size()) return false;
+    item = fNextStart++;
+    return true;
+  }
+
+  void Work(int t, const DefineFunc& define, const MergeFunc& merge, std::vector<std::unique_ptr<T>>& totals)
+  {
+    size_t i;
+    while(Take(i)){
+      FileStats& stats = fStats[i];
+      stats.thread = t;
+      const auto start = std::chrono::steady_clock::now();
+
+      std::unique_ptr<Part> part(new Part);
+      if(fTryCached) part->result.reset(fTryCached(fFiles[i]));
+
+      if(part->result){
+        stats.cached = true;
+      }
+      else{
+        std::atomic<long>& events = fEvents[t].n;
+        const long eventsBefore = events;
+        std::unique_ptr<ana::Spectrum> counter;
+        {
+          std::lock_guard<std::mutex> lock(DefineMutex());
+          part->loader.reset(new ana::SpectrumLoader(fFiles[i]));
+          part->result.reset(define(*part->loader));
+          // Sees every event and never passes, just to count them as they go
+          const ana::Cut kCount([&events](const caf::SRProxy*){ events.fetch_add(1, std::memory_order_relaxed); return false; });
+          const ana::Var kZero([](const caf::SRProxy*){ return 0.; });
+          counter.reset(new ana::Spectrum(*part->loader, ana::HistAxis("", ana::Binning::Simple(1, 0, 1), kZero), kCount));
+        }
+        part->loader->Go();
+        {
+          std::lock_guard<std::mutex> lock(DefineMutex());
+          counter.reset();
+        }
+
+        stats.events = events - eventsBefore;
+        if(fAfterRead) fAfterRead(fFiles[i], *part->result);
+      }
+      stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      // Park the part, then merge everything that is now next in file order.
+      // Merging can copy Spectra (AddExposure does) and destroying a part
+      // unregisters its Spectra from the loader, so both hold DefineMutex too.
+      {
+        std::lock_guard<std::mutex> lock(fMergeMutex);
+        fParts[i] = std::move(part);
+        if(fParts[fNextMerge]){
+          std::lock_guard<std::mutex> defineLock(DefineMutex());
+          while(fNextMerge < fParts.size() && fParts[fNextMerge]){
+            merge(*totals[fInputs[fNextMerge]], *fParts[fNextMerge]->result);
+            fParts[fNextMerge].reset();
+            ++fNextMerge;
+          }
+        }
+      }
+      fAheadCond.notify_all();
+
+      {
+        std::lock_guard<std::mutex> doneLock(fDoneMutex);
+        ++fNDone;
+      }
+      fDoneCond.notify_all();
+    }
+  }
+
+  // Events read so far in this Go(), including files still being read
+  long Events() const
+  {
+    long n = 0;
+    for(const Counter& c: fEvents) n += c.n.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  // Bytes ROOT has read from any file since Go() started. ROOT only counts them
+  // for the whole process, so this includes anything else reading at the same
+  // time: put concurrent inputs through one loader rather than several.
+  long long BytesRead() const { return TFile::GetFileBytesRead() - fBytesAtStart; }
+
+  void Report(std::chrono::steady_clock::time_point start, std::ostream& os) const
+  {
+    const double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    os << fLabel << ": " << fNDone << "/" << fFiles.size() << " files, "
+       << std::setprecision(3) << Events()/dt << " events/s, " << BytesRead()/dt/1e6 << " MB/s read" << std::endl;
+  }
+
+  std::vector<std::string> fFiles; // Every wildcard's, in order
+  std::vector<size_t> fInputs; // Which wildcard each file came from
+  size_t fNInputs;
+  int fNThreads;
+  double fReportInterval = 10;
+  std::string fLabel = "ParallelLoader";
+  size_t fMaxAhead = 0;
+
+  std::function<T*(const std::string&)> fTryCached;
+  std::function<void(const std::string&, const T&)> fAfterRead;
+
+  std::vector<FileStats> fStats;
+
+  std::mutex fMergeMutex; // Guards the three below
+  std::condition_variable fAheadCond; // fNextMerge moved on
+  size_t fNextStart = 0;
+  std::vector<std::unique_ptr<Part>> fParts; // Finished, waiting for earlier files
+  size_t fNextMerge = 0;
+
+  std::mutex fDoneMutex;
+  std::condition_variable fDoneCond;
+  size_t fNDone = 0;
+
+  std::vector<Counter> fEvents;
+  Long64_t fBytesAtStart = 0;
+  long fTotalEvents = 0;
+  long long fTotalBytes = 0;
+  double fSeconds = 0;
+};
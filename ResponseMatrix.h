@@ -0,0 +1,346 @@
+#pragma once
+
+// True-vs-reco response matrices in banded column storage, for folding true
+// spectra many times over (e.g. inside a fit), plus the engine that fills one
+// per interaction mode and energy estimator in a single pass.
+
+#include "TH2.h" // 2-dimensional histogram
+#include "TDirectory.h"
+#include "TH1.h" // 1-dimensional histogram
+#include "TMatrixD.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "AnalysisDefs.h"
+#include "CutCategorizer.h"
+
+/*
+ Each true-energy bin (column) only spreads into a narrow band of reco bins,
+ so a column is stored as its first reco bin and the run of values from there.
+ While filling, the columns are separate vectors that grow to cover whatever
+ reco bins turn up. Finalize() packs them into one contiguous array and turns
+ counts into probabilities P(reco j | true i), which is what Fold() uses.
+ */
+class ResponseMatrix
+{
+public:
+  // Bin edges, any spacing. Events outside the reco edges still count towards
+  // their true bin, and so show up as inefficiency.
+  ResponseMatrix(const std::vector<double>& trueEdges, const std::vector<double>& recoEdges)
+    : fTrueEdges(trueEdges), fRecoEdges(recoEdges),
+      fColLo(NTrue(), 0), fColVals(NTrue()), fTrueTotal(NTrue(), 0)
+  {
+  }
+
+  int NTrue() const { return fTrueEdges.size()-1; }
+  int NReco() const { return fRecoEdges.size()-1; }
+
+  void Fill(double trueE, double recoE, double weight = 1)
+  {
+    const int i = FindBin(fTrueEdges, trueE);
+    if(i < 0) return;
+    fFinal = false; // Even if the reco is out of range, the efficiency changes
+    fTrueTotal[i] += weight;
+
+    const int j = FindBin(fRecoEdges, recoE);
+    if(j < 0) return;
+    Cell(i, j) += weight;
+  }
+
+  void Add(const ResponseMatrix& rhs)
+  {
+    fFinal = false;
+    for(int i = 0; i < NTrue(); ++i){
+      fTrueTotal[i] += rhs.fTrueTotal[i];
+      const std::vector<double>& v = rhs.fColVals[i];
+      for(size_t k = 0; k < v.size(); ++k) Cell(i, rhs.fColLo[i] + k) += v[k];
+    }
+  }
+
+  // Packs the bands for Fold(). Call after the last Fill().
+  void Finalize()
+  {
+    fOffset.assign(NTrue()+1, 0);
+    for(int i = 0; i < NTrue(); ++i) fOffset[i+1] = fOffset[i] + fColVals[i].size();
+
+    fProb.resize(fOffset.back());
+    for(int i = 0; i < NTrue(); ++i){
+      const double norm = fTrueTotal[i] > 0 ? 1/fTrueTotal[i] : 0;
+      for(size_t k = 0; k < fColVals[i].size(); ++k) fProb[fOffset[i]+k] = fColVals[i][k] * norm;
+    }
+    fFinal = true;
+  }
+
+  /*
+   recoOut = R trueSpec, with trueSpec NTrue() long and recoOut NReco() long.
+   No allocation, and one sequential sweep through the packed bands.
+   */
+  void Fold(const double* trueSpec, double* recoOut) const
+  {
+    CheckFinal("Fold");
+    std::fill(recoOut, recoOut+NReco(), 0.);
+    const double* p = fProb.data();
+    for(int i = 0; i < NTrue(); ++i){
+      const double t = trueSpec[i];
+      double* out = recoOut + fColLo[i];
+      const int n = fOffset[i+1] - fOffset[i];
+      for(int k = 0; k < n; ++k) out[k] += p[k] * t;
+      p += n;
+    }
+  }
+
+  // Everything filled into true bin i, whether or not it was reconstructed
+  double TrueTotal(int i) const { return fTrueTotal[i]; }
+
+  // Fraction of the events in each true bin that land in any reco bin
+  double Efficiency(int i) const
+  {
+    CheckFinal("Efficiency");
+    double eff = 0;
+    for(int k = fOffset[i]; k < fOffset[i+1]; ++k) eff += fProb[k];
+    return eff;
+  }
+
+  /*
+   Unfolding by inverting R. Needs NTrue() == NReco(), and amplifies
+   statistical noise badly for anything but a near-diagonal response; prefer
+   UnfoldBayes(). Returns false if R is singular.
+   */
+  bool UnfoldInvert(const double* recoSpec, double* trueOut) const
+  {
+    CheckFinal("UnfoldInvert");
+    if(NTrue() != NReco()) return false;
+    TMatrixD R(NReco(), NTrue());
+    for(int i = 0; i < NTrue(); ++i)
+      for(int k = fOffset[i]; k < fOffset[i+1]; ++k) R(fColLo[i] + k - fOffset[i], i) = fProb[k];
+
+    double det = 0;
+    R.Invert(&det);
+    if(det == 0 || !R.IsValid()) return false;
+
+    for(int i = 0; i < NTrue(); ++i){
+      trueOut[i] = 0;
+      for(int j = 0; j < NReco(); ++j) trueOut[i] += R(i, j) * recoSpec[j];
+    }
+    return true;
+  }
+
+  // Iterative Bayesian (D'Agostini) unfolding, starting from prior
+  void UnfoldBayes(const double* recoSpec, const double* prior, int nIter, double* trueOut) const
+  {
+    CheckFinal("UnfoldBayes");
+    std::vector<double> folded(NReco()), ratio(NReco());
+    std::copy(prior, prior+NTrue(), trueOut);
+
+    for(int iter = 0; iter < nIter; ++iter){
+      Fold(trueOut, folded.data());
+      for(int j = 0; j < NReco(); ++j) ratio[j] = folded[j] > 0 ? recoSpec[j]/folded[j] : 0;
+
+      const double* p = fProb.data();
+      for(int i = 0; i < NTrue(); ++i){
+        const int n = fOffset[i+1] - fOffset[i];
+        double sum = 0, eff = 0;
+        for(int k = 0; k < n; ++k){
+          sum += p[k] * ratio[fColLo[i]+k];
+          eff += p[k];
+        }
+        trueOut[i] = eff > 0 ? trueOut[i] * sum / eff : 0;
+        p += n;
+      }
+    }
+  }
+
+  // Counts, true on x and reco on y as in SmearMatrix.C. The caller owns it.
+  TH2D* ToTH2(const std::string& name, const std::string& title) const
+  {
+    TH2D* h = new TH2D(name.c_str(), title.c_str(), NTrue(), &fTrueEdges[0], NReco(), &fRecoEdges[0]);
+    h->SetDirectory(0);
+    for(int i = 0; i < NTrue(); ++i)
+      for(size_t k = 0; k < fColVals[i].size(); ++k)
+        h->SetBinContent(i+1, fColLo[i]+k+1, fColVals[i][k]);
+    return h;
+  }
+
+  // Counts and true totals, for AddFrom() to read back
+  void SaveTo(TDirectory* dir, const std::string& name) const
+  {
+    TH2D* h = ToTH2(name, "");
+    TH1D hTot((name+"_truetotal").c_str(), "", NTrue(), &fTrueEdges[0]);
+    hTot.SetDirectory(0);
+    for(int i = 0; i < NTrue(); ++i) hTot.SetBinContent(i+1, fTrueTotal[i]);
+    dir->WriteTObject(h);
+    dir->WriteTObject(&hTot);
+    delete h;
+  }
+
+  void AddFrom(TDirectory* dir, const std::string& name)
+  {
+    const TH2* h = (TH2*)dir->Get(name.c_str());
+    const TH1* hTot = (TH1*)dir->Get((name+"_truetotal").c_str());
+    fFinal = false;
+    for(int i = 0; i < NTrue(); ++i){
+      fTrueTotal[i] += hTot->GetBinContent(i+1);
+      for(int j = 0; j < NReco(); ++j){
+        const double c = h->GetBinContent(i+1, j+1);
+        if(c != 0) Cell(i, j) += c;
+      }
+    }
+  }
+
+  std::string Definition() const
+  {
+    std::string def = "true";
+    for(double e: fTrueEdges) def += " " + std::to_string(e);
+    def += " reco";
+    for(double e: fRecoEdges) def += " " + std::to_string(e);
+    return def;
+  }
+
+  // Number of stored elements, against NTrue()*NReco() for a dense matrix
+  size_t NStored() const
+  {
+    size_t n = 0;
+    for(const std::vector<double>& v: fColVals) n += v.size();
+    return n;
+  }
+
+protected:
+  // Everything that reads the probabilities needs them to be up to date
+  void CheckFinal(const char* caller) const
+  {
+    if(!fFinal){
+      std::cout << "ResponseMatrix::" << caller << "() called without Finalize() after the last fill" << std::endl;
+      abort();
+    }
+  }
+
+  static int FindBin(const std::vector<double>& edges, double x)
+  {
+    if(!(x >= edges.front() && x < edges.back())) return -1; // Also catches NaN
+    return std::upper_bound(edges.begin(), edges.end(), x) - edges.begin() - 1;
+  }
+
+  // Element (reco j, true i), widening column i's band to cover j if needed
+  double& Cell(int i, int j)
+  {
+    std::vector<double>& vals = fColVals[i];
+    if(vals.empty()){
+      fColLo[i] = j;
+      vals.push_back(0);
+    }
+    else if(j < fColLo[i]){
+      vals.insert(vals.begin(), fColLo[i]-j, 0);
+      fColLo[i] = j;
+    }
+    else if(j >= fColLo[i] + int(vals.size())){
+      vals.resize(j - fColLo[i] + 1, 0);
+    }
+    return vals[j - fColLo[i]];
+  }
+
+  std::vector<double> fTrueEdges, fRecoEdges;
+
+  // Filling
+  std::vector<int> fColLo; // First reco bin of each column
+  std::vector<std::vector<double>> fColVals;
+  std::vector<double> fTrueTotal;
+
+  // Packed by Finalize(), and stale after any Fill(), Add() or AddFrom()
+  bool fFinal = false;
+  std::vector<int> fOffset; // Column i is fProb[fOffset[i], fOffset[i+1])
+  std::vector<double> fProb;
+};
+
+/*
+ One ResponseMatrix per interaction mode (kModeLabels) and energy estimator,
+ all filled from the same pass. The mode picks the matrix row directly through
+ kModeIndex, so there are no per-mode cuts. Attach with CutCategorizer::AddSink.
+ */
+class ResponseEngine: public IEventSink
+{
+public:
+  struct Estimator
+  {
+    std::string name;
+    ana::Var var;
+  };
+
+  ResponseEngine(CutCategorizer& cat, const std::vector<Estimator>& estimators,
+                 const std::vector<double>& trueEdges, const std::vector<double>& recoEdges,
+                 const Selection& sel = Selection())
+    : fSel(sel), fEstimators(estimators)
+  {
+    fTrueSlot = cat.VarSlot(ana::kTrueEnergy);
+    fModeSlot = cat.VarSlot(kModeIndex);
+    for(const Estimator& est: estimators) fEstSlots.push_back(cat.VarSlot(est.var));
+
+    for(size_t m = 0; m < kModeLabels.size(); ++m)
+      for(size_t e = 0; e < estimators.size(); ++e)
+        fMatrices.emplace_back(trueEdges, recoEdges);
+  }
+
+  void Fill(CutCategorizer& cat, const caf::SRProxy* sr, uint64_t mask) override
+  {
+    if(!fSel.Pass(mask)) return;
+    const int mode = cat.VarValue(fModeSlot, sr);
+    if(mode < 0) return;
+
+    const double trueE = cat.VarValue(fTrueSlot, sr);
+    ResponseMatrix* row = &fMatrices[mode * fEstimators.size()];
+    for(size_t e = 0; e < fEstSlots.size(); ++e) row[e].Fill(trueE, cat.VarValue(fEstSlots[e], sr));
+  }
+
+  void Finalize() { for(ResponseMatrix& m: fMatrices) m.Finalize(); }
+
+  void Add(const IEventSink& rhs) override
+  {
+    const ResponseEngine& r = dynamic_cast<const ResponseEngine&>(rhs);
+    for(size_t i = 0; i < fMatrices.size(); ++i) fMatrices[i].Add(r.fMatrices[i]);
+  }
+
+  void SaveTo(TDirectory* dir) const override
+  {
+    for(size_t i = 0; i < fMatrices.size(); ++i) fMatrices[i].SaveTo(dir, Name(i));
+  }
+
+  void AddFrom(TDirectory* dir) override
+  {
+    for(size_t i = 0; i < fMatrices.size(); ++i) fMatrices[i].AddFrom(dir, Name(i));
+  }
+
+  std::string Definition() const override
+  {
+    std::string def = "ResponseEngine " + std::to_string(fSel.on) + " " + std::to_string(fSel.off);
+    for(const Estimator& est: fEstimators) def += " " + est.name;
+    return def + " " + fMatrices.front().Definition();
+  }
+
+  size_t NMatrices() const { return fMatrices.size(); }
+  // Name "<mode>_<estimator>", e.g. "MEC_EReco"
+  std::string Name(int i) const
+  {
+    return kModeLabels[i / fEstimators.size()] + "_" + fEstimators[i % fEstimators.size()].name;
+  }
+
+  ResponseMatrix& Matrix(int i) { return fMatrices[i]; }
+  ResponseMatrix& Matrix(int mode, int estimator) { return fMatrices[mode * fEstimators.size() + estimator]; }
+
+protected:
+  Selection fSel;
+  std::vector<Estimator> fEstimators;
+  int fTrueSlot, fModeSlot;
+  std::vector<int> fEstSlots;
+  std::vector<ResponseMatrix> fMatrices; // Mode-major
+};
+
+// The three estimators compared in RecoMethods.C. Every user selects with
+// kValidReco, so events with a NaN or non-positive Ev_reco are left out
+// altogether, as in SmearMatrix.C, and never reach the first reco bin.
+const std::vector<ResponseEngine::Estimator> kRecoEstimators = {
+  {"EReco", kRecoEnergy}, {"EQE", kQEFormulaEnergy}, {"ConservedEReco", kConservedEReco}
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+// Per-file cache of partial results (one CutCategorizer's worth), so a rerun
+// only processes files that are new or changed since the last one.
+
+#include "TFile.h"
+#include "TMD5.h"
+#include "TSystem.h"
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "CutCategorizer.h"
+
+/*
+ An entry is keyed by the MD5 of the input file's contents, the MD5 of the
+ source files the analysis is built from (so editing a Cut or Var lambda
+ invalidates everything), and the CutCategorizer's Definition() (so changing a
+ binning or adding a spectrum does). Stale entries are never read again, but
+ are not deleted either; clear the directory by hand now and then.
+
+ Hashing a CAF means reading all of it, so content hashes are remembered in
+ <dir>/filehashes.txt against the file's path, size and modification time, and
+ only recomputed when one of those changes.
+
+ All methods can be called from several threads at once.
+ */
+class ResultCache
+{
+public:
+  ResultCache(const std::string& dir, const std::vector<std::string>& sources) : fDir(dir)
+  {
+    gSystem->mkdir(dir.c_str(), true);
+
+    fSourceHash = SourcesHash(sources);
+    if(fSourceHash.empty()){
+      std::cout << "ResultCache: caching disabled" << std::endl;
+      fDisabled = true;
+      return;
+    }
+
+    std::ifstream index(IndexName());
+    std::string line;
+    while(std::getline(index, line)){
+      const size_t tab = line.rfind('\t');
+      if(tab != std::string::npos) fFileHashes[line.substr(0, tab)] = line.substr(tab+1);
+    }
+  }
+
+  /*
+   One MD5 for the contents of all of sources, or "" if any can't be read.
+   Anything else saved from an analysis (e.g. BinningStudy.C's masters) can
+   store it and compare it on reading, as the cache keys do.
+   */
+  static std::string SourcesHash(const std::vector<std::string>& sources)
+  {
+    std::string allSources;
+    for(const std::string& src: sources){
+      TMD5* md5 = TMD5::FileChecksum(src.c_str());
+      if(!md5){
+        std::cout << "ResultCache: can't read " << src << std::endl;
+        return "";
+      }
+      allSources += md5->AsString();
+      delete md5;
+    }
+    return MD5String(allSources);
+  }
+
+  // MD5 of path's contents, or "" if it can't be read
+  std::string FileHash(const std::string& path)
+  {
+    FileStat_t st;
+    if(gSystem->GetPathInfo(path.c_str(), st) != 0) return "";
+    std::ostringstream sig;
+    sig << path << " " << st.fSize << " " << st.fMtime;
+
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      auto it = fFileHashes.find(sig.str());
+      if(it != fFileHashes.end()) return it->second;
+    }
+
+    TMD5* md5 = TMD5::FileChecksum(path.c_str());
+    if(!md5) return "";
+    const std::string hash = md5->AsString();
+    delete md5;
+
+    std::lock_guard<std::mutex> lock(fMutex);
+    fFileHashes[sig.str()] = hash;
+    std::ofstream index(IndexName(), std::ios::app);
+    index << sig.str() << "\t" << hash << "\n";
+    return hash;
+  }
+
+  // The entry name for input file path analysed by cat, "" if uncacheable
+  std::string Key(const std::string& path, const CutCategorizer& cat)
+  {
+    if(fDisabled) return "";
+    const std::string fileHash = FileHash(path);
+    if(fileHash.empty()) return "";
+    return MD5String(fileHash + fSourceHash + cat.Definition());
+  }
+
+  // Whether there is an entry for key, without reading it
+  bool Has(const std::string& key) const
+  {
+    return !key.empty() && !gSystem->AccessPathName(EntryName(key).c_str()); // Yes, true means missing
+  }
+
+  // Adds the cached result for key into cat. False if there is none.
+  bool AddTo(const std::string& key, CutCategorizer& cat) const
+  {
+    if(!Has(key)) return false;
+    TFile f(EntryName(key).c_str());
+    if(f.IsZombie()) return false;
+    cat.AddFrom(&f);
+    return true;
+  }
+
+  void Save(const std::string& key, const CutCategorizer& cat) const
+  {
+    if(key.empty()) return;
+    // Write then rename, so a crash can't leave a half-written entry behind
+    const std::string tmp = EntryName(key) + ".tmp" + std::to_string(gSystem->GetPid());
+    {
+      TFile f(tmp.c_str(), "RECREATE");
+      cat.SaveTo(&f);
+    }
+    gSystem->Rename(tmp.c_str(), EntryName(key).c_str());
+  }
+
+protected:
+  static std::string MD5String(const std::string& s)
+  {
+    TMD5 md5;
+    md5.Update((const UChar_t*)s.data(), s.size());
+    md5.Final();
+    return md5.AsString();
+  }
+
+  std::string IndexName() const { return fDir + "/filehashes.txt"; }
+  std::string EntryName(const std::string& key) const { return fDir + "/" + key + ".root"; }
+
+  std::string fDir;
+  std::string fSourceHash;
+  bool fDisabled = false;
+
+  std::mutex fMutex;
+  std::map<std::string, std::string> fFileHashes; // "path size mtime" -> MD5
+};